@@ -27,29 +27,39 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 /*
-** In mpc the input type has three modes of
-** operation: String, File and Pipe.
+** In mpc the input type has four modes of
+** operation: String, Borrowed, File and Pipe.
 **
 ** String is easy. The whole contents are
 ** loaded into a buffer and scanned through.
 ** The cursor can jump around at will making
 ** backtracking easy.
 **
-** The second is a File which is also somewhat
-** easy. The contents are never loaded into
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** Borrowed is a String which is not copied.
+** The caller's buffer and filename are used in
+** place for the duration of the parse, the
+** buffer with an explicit length so it needs no
+** terminator. Positions index the caller's
+** buffer, so it can be sliced with them.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** File and Pipe share the rest. The input is
+** read into a window which slides along it. The
+** window always starts at the first mark, or at
+** the cursor when there are no marks, so
+** anything we may backtrack to is still in
+** memory and backtracking is just moving the
+** cursor. When the cursor reaches the end of the
+** window it is refilled. Once the window is full
+** what is no longer needed is dropped, and it is
+** grown if a mark keeps most of it.
 **
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** A File is read in large blocks, ahead of the
+** cursor, and seeked back to the end of what was
+** parsed once the parse is done. A Pipe may not
+** have more input ready, so it is read only one
+** character at a time as the parse looks at it,
+** and any that were backtracked over are pushed
+** back once the parse is done, as before.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -58,9 +68,10 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 enum {
-  MPC_INPUT_STRING = 0,
-  MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_STRING   = 0,
+  MPC_INPUT_FILE     = 1,
+  MPC_INPUT_PIPE     = 2,
+  MPC_INPUT_BORROWED = 3
 };
 
 enum {
@@ -71,6 +82,10 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_BUFFER_MIN = 65536
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
@@ -85,6 +100,12 @@ typedef struct {
   char *buffer;
   FILE *file;
 
+  long buffer_pos;
+  size_t buffer_len;
+  size_t buffer_slots;
+  int buffer_end;
+  long file_start;
+
   int suppress;
   int backtrack;
   int marks_slots;
@@ -114,6 +135,11 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
+  i->buffer_end = 1;
+  i->file_start = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -144,6 +170,50 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string[length] = '\0';
   i->buffer = NULL;
   i->file = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
+  i->buffer_end = 1;
+  i->file_start = 0;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+  i->mem_index = 0;
+  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+
+  return i;
+
+}
+
+/*
+** A Borrowed input is a window already holding
+** all of the input, which never needs a refill.
+*/
+
+static mpc_input_t *mpc_input_new_borrowed(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+
+  i->filename = (char*)filename;
+  i->type = MPC_INPUT_BORROWED;
+
+  i->state = mpc_state_new();
+
+  i->string = NULL;
+  i->buffer = (char*)string;
+  i->file = NULL;
+
+  i->buffer_pos = 0;
+  i->buffer_len = length;
+  i->buffer_slots = length;
+  i->buffer_end = 1;
+  i->file_start = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -171,9 +241,15 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->buffer = malloc(MPC_INPUT_BUFFER_MIN);
   i->file = pipe;
 
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+  i->buffer_end = 0;
+  i->file_start = 0;
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -199,9 +275,15 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->buffer = malloc(MPC_INPUT_BUFFER_MIN);
   i->file = file;
 
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+  i->buffer_end = 0;
+  i->file_start = ftell(file);
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -218,10 +300,23 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
 static void mpc_input_delete(mpc_input_t *i) {
 
-  free(i->filename);
+  long j;
+
+  if (i->type == MPC_INPUT_PIPE) {
+    for (j = (long)i->buffer_len - 1; j >= i->state.pos - i->buffer_pos; j--) {
+      ungetc(i->buffer[j], i->file);
+    }
+  }
+
+  if (i->type != MPC_INPUT_BORROWED) {
+    free(i->filename);
+    free(i->buffer);
+  }
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_FILE && i->file_start != -1) {
+    fseek(i->file, i->file_start + i->state.pos, SEEK_SET);
+  }
 
   free(i->marks);
   free(i->lasts);
@@ -313,14 +408,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,14 +425,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -352,80 +434,63 @@ static void mpc_input_rewind(mpc_input_t *i) {
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
 
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
-}
-
-static char mpc_input_getc(mpc_input_t *i) {
-
-  char c = '\0';
+/*
+** Reads more of a File or Pipe into the window,
+** returning 0 once there is no more to read.
+*/
 
-  switch (i->type) {
+static int mpc_input_buffer_fill(mpc_input_t *i) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
+  long keep;
+  size_t n;
+  int c;
 
-      if (!i->buffer) { c = getc(i->file); return c; }
+  if (i->buffer_end) { return 0; }
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+  if (i->buffer_len == i->buffer_slots) {
+    keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+    n = (size_t)(keep - i->buffer_pos);
+    memmove(i->buffer, i->buffer + n, i->buffer_len - n);
+    i->buffer_len -= n;
+    i->buffer_pos = keep;
 
-    default: return c;
+    if (i->buffer_len > i->buffer_slots / 2) {
+      i->buffer_slots *= 2;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
   }
-}
 
-static char mpc_input_peekc(mpc_input_t *i) {
-
-  char c = '\0';
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE:
-
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
+  if (i->type == MPC_INPUT_PIPE) {
+    c = getc(i->file);
+    if (c == EOF) { i->buffer_end = 1; return 0; }
+    i->buffer[i->buffer_len++] = (char)c;
+    return 1;
+  }
 
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
+  n = fread(i->buffer + i->buffer_len, 1,
+    i->buffer_slots - i->buffer_len, i->file);
+  i->buffer_len += n;
 
-    case MPC_INPUT_PIPE:
+  if (n == 0) { i->buffer_end = 1; }
+  return n > 0;
+}
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+static char mpc_input_getc(mpc_input_t *i) {
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+  if (i->type == MPC_INPUT_STRING) { return i->string[i->state.pos]; }
 
-    default: return c;
+  while (i->state.pos >= i->buffer_pos + (long)i->buffer_len) {
+    if (!mpc_input_buffer_fill(i)) { return '\0'; }
   }
 
+  return i->buffer[i->state.pos - i->buffer_pos];
+}
+
+static char mpc_input_peekc(mpc_input_t *i) {
+  return mpc_input_getc(i);
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
@@ -433,34 +498,12 @@ static int mpc_input_terminated(mpc_input_t *i) {
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
-    default: { break; }
-  }
+  (void)i; (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -1334,6 +1377,14 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+int mpc_parse_borrowed(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
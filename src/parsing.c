@@ -1,21 +1,30 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
-#include "mpc.h"
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <editline/readline.h>
 #include <editline/history.h>
 
 #define LASSERT(args, cond, fmt, ...) \
     if (!(cond)) {  \
-        lval* err = lval_err(fmt, ##__VA_ARGS__); \
-        lval_del(args); \
-        return err; \
+        return lval_err(fmt, ##__VA_ARGS__); \
     }
 
 #define LASSERT_TYPE(func, args, index, expected) \
-    LASSERT(args, args->cell[index]->type == expected, \
+    LASSERT(args, lval_type(args->cell[index]) == expected, \
         "Function '%s' passed incorrect type for argument %d!" \
         "Expected %s, got %s", func, index, ltype_name(expected),\
-        ltype_name(args->cell[index]->type));
+        ltype_name(lval_type(args->cell[index])));
 
 #define LASSERT_NUM_ARGS(func, args, expected) \
     LASSERT(args, args->count == expected, \
@@ -28,110 +37,558 @@
 
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+
+enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN,
+    LVAL_CELLS };
 
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
+/* Operators shared by groups of builtins. Arithmetic and comparison
+ * builtins carry theirs so the VM can apply them to two numbers directly. */
+enum { LOP_NONE = -1, LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_EQ, LOP_NE,
+    LOP_GT, LOP_LT, LOP_GE, LOP_LE, LOP_DEF, LOP_PUT };
+
+char* lop_name[] = { "+", "-", "*", "/", "==", "!=", ">", "<", ">=", "<=",
+    "def", "=" };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Values are owned by the garbage collector and shared freely. Builtins
+ * build new values rather than modify their arguments, with the exception
+ * of the argument list itself which is private to the call. Since a list
+ * is never modified once it is a value, a slice of it can borrow its cells
+ * rather than copy them: base is then the list owning the cells, and cap
+ * is 0. Lists joined onto the front of another share its cells the same
+ * way, from a base of type LVAL_CELLS that is never a value itself: its
+ * cells in use run from count to cap, with room for more before them.
+ *
+ * The fields of each type share storage, and a value is only allocated as
+ * large as its type needs, see lval_size. */
 struct lval {
     int type;
-    long num;
-    char* err;
-    char* sym;
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
-
-    int count;
-    struct lval** cell;
+    int flags;
+    lval* next;
+
+    union {
+        long num;
+        char* err;
+        char* sym;
+        char* str;
+        struct {
+            int count;
+            int cap;
+            struct lval** cell;
+            struct lval* base;
+        };
+        struct {
+            lbuiltin builtin;
+            lenv* env;
+            lcode* code;
+            int bound;
+            int op;
+        };
+    };
 };
 
+size_t lval_size(int type) {
+    switch (type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        case LVAL_CELLS: return offsetof(lval, base) + sizeof(lval*);
+        case LVAL_FUN: return sizeof(lval);
+        default: return offsetof(lval, num) + sizeof(long);
+    }
+}
+
+/* Numbers that fit in all but one bit of a pointer are stored in the
+ * pointer itself, tagged by setting its low bit. Any other lval* points to
+ * an object on the heap, which is always aligned. */
+#define LVAL_FIXNUM(v) ((size_t)(v) & 1)
+#define LFIX_MIN (LONG_MIN / 2)
+#define LFIX_MAX (LONG_MAX / 2)
+
+int lval_type(lval* v) {
+    return LVAL_FIXNUM(v) ? LVAL_NUM : v->type;
+}
+
+long lval_number(lval* v) {
+    return LVAL_FIXNUM(v) ? (long)(size_t)v >> 1 : v->num;
+}
+
 struct lenv {
+    int flags;
+    lenv* next;
+
     lenv* par;
+    lenv* outer;
+    int base;
     int count;
-    char **syms;
+    int cap;
+    lval** syms;
     lval** vals;
+
+    int index_size;
+    int* index;
+};
+
+enum { OP_CONST, OP_LOOKUP, OP_LOCAL, OP_CALL, OP_TAILCALL, OP_IF, OP_JUMP,
+    OP_GUARD, OP_RET };
+
+/* Compiled form of an expression. Operands are stored inline after each
+ * opcode. The code of a lambda also keeps its formals and body, which are
+ * never modified once compiled so every copy of the function and every
+ * running frame can share them. Code lives in the old generation and is
+ * freed by a major collection once no function or frame refers to it. */
+struct lcode {
+    lcode* next;
+    int epoch;
+    int version;
+    int count;
+    int ops_size;
+    int* ops;
+    int nconsts;
+    int consts_size;
+    lval** consts;
+
+    lval* formals;
+    lval* body;
 };
 
+/* A frame owns its environment when it was created for the call running
+ * in it, rather than shared with the code that called 'eval'. size counts
+ * the heap bytes the call took for its environment and arguments. */
+typedef struct {
+    lcode* code;
+    int ip;
+    lenv* env;
+    int owner;
+    size_t size;
+} lframe;
+
+typedef struct {
+    int sp;
+    int stack_size;
+    lval** stack;
+
+    int fp;
+    int frames_size;
+    lframe* frames;
+    size_t heap;
+
+    lcode* cont;
+    int version;
+    int loads;
+} lvm;
+
+lvm vm = { .version = 1 };
+
+/* Bytes the VM stack and frames, together with the environment and argument
+ * list of each call in them, may take before a call fails with an error.
+ * Evaluation runs entirely on these, so this is what bounds recursion. */
+#ifndef LVM_STACK_LIMIT
+#define LVM_STACK_LIMIT (64 << 20)
+#endif
+
+/* Each 'load' runs the forms of its file in a VM loop nested on the C
+ * stack, so how deep loads nest is bounded on its own. */
+#ifndef LVM_LOAD_LIMIT
+#define LVM_LOAD_LIMIT 256
+#endif
+
+/* Nested values are walked with explicit stacks of pending work, this
+ * one or the compiler's ltasks, rather than by recursion. The reader,
+ * the compiler, the printer and lval_eq all do so, so the depth of
+ * nesting they handle is not limited by the C stack. */
+typedef struct {
+    int count;
+    int size;
+    void** items;
+} lstack;
+
+void lstack_push(lstack* s, void* p) {
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 256;
+        s->items = realloc(s->items, sizeof(void*) * s->size);
+    }
+    s->items[s->count++] = p;
+}
+
+void* lstack_pop(lstack* s) {
+    return s->items[--s->count];
+}
+
+#define LGC_MIN_THRESHOLD 4096
+#define LGC_NURSERY_SIZE (1 << 20)
+#define LGC_ARENA_SIZE (16 << 20)
+
+#define LGC_MARK 1
+#define LGC_YOUNG 2
+#define LGC_MOVED 4
+#define LGC_REMEMBERED 8
+
+/* Symbols ever bound outside the global environment are never folded by
+ * the compiler, and rebinding one it did fold invalidates compiled code,
+ * see OP_GUARD. These share the flags field with the collector. */
+#define LSYM_LOCAL 16
+#define LSYM_FOLDED 32
+
+/* An environment left behind by a tail call, which no VM frame runs in
+ * any more and only the frames called from it still see, see lvm_call */
+#define LENV_LEFT 64
+
+/* Nursery memory. Objects are bump allocated in the newest chunk, a new
+ * chunk is only chained on when it fills up before the next collection. */
+typedef struct lchunk {
+    struct lchunk* next;
+    char* top;
+    char* end;
+} lchunk;
+
+#define LPOOL_CLASSES 32
+#define LPOOL_SLAB (1 << 16)
+
+typedef struct lfree {
+    struct lfree* next;
+} lfree;
+
+/* Old objects, their strings and arrays, and compiled code come from a
+ * pool of size classes 8 bytes apart up to 256 bytes. Each class keeps a
+ * free list, and new blocks are carved out of large slabs which are never
+ * given back. Larger blocks go to malloc. Callers pass the size back when
+ * freeing. Live and peak block counts are kept per class, the last entry
+ * counting large blocks. */
+typedef struct {
+    lfree* free[LPOOL_CLASSES];
+    lchunk* slabs;
+
+    long live[LPOOL_CLASSES + 1];
+    long peak[LPOOL_CLASSES + 1];
+} lpool;
+
+lpool pool;
+
+int lpool_class(size_t size) {
+    int k = size ? (size - 1) / 8 : 0;
+    return k < LPOOL_CLASSES ? k : LPOOL_CLASSES;
+}
+
+void* lpool_alloc(size_t size) {
+    int k = lpool_class(size);
+    if (++pool.live[k] > pool.peak[k]) { pool.peak[k] = pool.live[k]; }
+
+    if (k == LPOOL_CLASSES) { return malloc(size); }
+
+    if (pool.free[k]) {
+        lfree* f = pool.free[k];
+        pool.free[k] = f->next;
+        return f;
+    }
+
+    size_t n = (k + 1) * 8;
+    lchunk* c = pool.slabs;
+    if (!c || c->top + n > c->end) {
+        c = malloc(sizeof(lchunk) + LPOOL_SLAB);
+        c->top = (char*)(c + 1);
+        c->end = c->top + LPOOL_SLAB;
+        c->next = pool.slabs;
+        pool.slabs = c;
+    }
+
+    void* p = c->top;
+    c->top += n;
+    return p;
+}
+
+void lpool_free(void* p, size_t size) {
+    if (!p) { return; }
+
+    int k = lpool_class(size);
+    pool.live[k]--;
+
+    if (k == LPOOL_CLASSES) {
+        free(p);
+        return;
+    }
+
+    lfree* f = p;
+    f->next = pool.free[k];
+    pool.free[k] = f;
+}
+
+void* lpool_realloc(void* p, size_t old, size_t size) {
+    if (p && lpool_class(old) == lpool_class(size)
+        && lpool_class(size) < LPOOL_CLASSES) {
+        return p;
+    }
+
+    void* n = lpool_alloc(size);
+    if (p) {
+        memcpy(n, p, old < size ? old : size);
+        lpool_free(p, old);
+    }
+    return n;
+}
+
+/* The heap has two generations. New objects, together with their strings
+ * and arrays, are bump allocated in the nursery. A minor collection copies
+ * the ones still reachable into the old generation, where they are
+ * allocated from the pool and linked in the lists below, and empties the
+ * nursery. Old objects are reclaimed by a major mark-and-sweep collection
+ * once their number has doubled since the previous one, or when the 'gc'
+ * builtin asks for it.
+ *
+ * Roots are the global environment and the VM stack and frames. Old
+ * objects that had a young object stored into them are remembered and
+ * treated as roots by the next minor collection. Collections only run at
+ * a safe point of the VM, where everything live is reachable from roots.
+ *
+ * While a top-level form is evaluated the nursery serves as its arena. It
+ * grows up to LGC_ARENA_SIZE before a minor collection is due, and once the
+ * form is done a single one keeps what the global environment refers to
+ * and releases the rest. */
+typedef struct {
+    lchunk* nursery;
+    lchunk* spare;
+    size_t young;
+    int arena;
+
+    lval* vals;
+    lenv* envs;
+    lcode* codes;
+    lenv* root;
+
+    int count;
+    int threshold;
+    int pending;
+    int full;
+    int epoch;
+
+    lstack grey;
+    lstack grey_envs;
+    lstack remembered;
+    lstack remembered_envs;
+    lstack slices;
+} lgc;
+
+lgc gc = { .threshold = LGC_MIN_THRESHOLD, .epoch = 1 };
+
 lval* lval_eval(lenv* e, lval* v);
 void lval_print(lval* v);
-lval* lval_copy(lval* v);
-void lval_del(lval* v);
 lval* lval_err(char* fmt, ...);
+lcode* lval_compile_lambda(lval* formals, lval* body);
+
+void lgc_count(void) {
+    if (++gc.count > gc.threshold) { gc.pending = gc.full = 1; }
+}
+
+void* lgc_bump(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+
+    lchunk* c = gc.nursery;
+    if (!c || c->top + size > c->end) {
+        size_t n = size > LGC_NURSERY_SIZE ? size : LGC_NURSERY_SIZE;
+        if (gc.spare && n == LGC_NURSERY_SIZE) {
+            c = gc.spare;
+            gc.spare = c->next;
+        } else {
+            c = malloc(sizeof(lchunk) + n);
+            c->end = (char*)(c + 1) + n;
+        }
+        c->top = (char*)(c + 1);
+        c->next = gc.nursery;
+        gc.nursery = c;
+        gc.young += n;
+        if (c->next && (!gc.arena || gc.young > LGC_ARENA_SIZE)) {
+            gc.pending = 1;
+        }
+    }
+
+    void* p = c->top;
+    c->top += size;
+    return p;
+}
+
+/* Strings and arrays live in the same generation as their owner. */
+void* lgc_alloc(int flags, size_t size) {
+    return flags & LGC_YOUNG ? lgc_bump(size) : lpool_alloc(size);
+}
+
+void lgc_free(int flags, void* p, size_t size) {
+    if (!(flags & LGC_YOUNG)) { lpool_free(p, size); }
+}
 
-char* dupstr(char * str) {
-    char * s = malloc(strlen(str) + 1);
+void* lgc_realloc(int flags, void* p, size_t old, size_t size) {
+    if (!(flags & LGC_YOUNG)) { return lpool_realloc(p, old, size); }
+
+    void* n = lgc_bump(size);
+    if (old) { memcpy(n, p, old); }
+    return n;
+}
+
+char* lgc_strdup(int flags, char* str) {
+    char* s = lgc_alloc(flags, strlen(str) + 1);
     strcpy(s, str);
     return s;
 }
 
+void lgc_remember(lval* v, lval* x) {
+    if (!LVAL_FIXNUM(x) && (x->flags & LGC_YOUNG) && !(v->flags & (LGC_YOUNG | LGC_REMEMBERED))) {
+        v->flags |= LGC_REMEMBERED;
+        lstack_push(&gc.remembered, v);
+    }
+}
+
+void lgc_remember_env(lenv* e, lval* x) {
+    if (!LVAL_FIXNUM(x) && (x->flags & LGC_YOUNG) && !(e->flags & (LGC_YOUNG | LGC_REMEMBERED))) {
+        e->flags |= LGC_REMEMBERED;
+        lstack_push(&gc.remembered_envs, e);
+    }
+}
+
+void lgc_remember_par(lenv* e) {
+    if (e->par && (e->par->flags & LGC_YOUNG) && !(e->flags & (LGC_YOUNG | LGC_REMEMBERED))) {
+        e->flags |= LGC_REMEMBERED;
+        lstack_push(&gc.remembered_envs, e);
+    }
+}
+
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lgc_bump(sizeof(lenv));
+    e->flags = LGC_YOUNG;
+    e->next = NULL;
+
     e->par = NULL;
+    e->outer = NULL;
+    e->base = 0;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index_size = 0;
+    e->index = NULL;
     return e;
 }
 
-void lenv_del(lenv* e) {
+void lenv_free(lenv* e) {
+    lpool_free(e->index, sizeof(int) * e->index_size);
+    lpool_free(e->syms, sizeof(lval*) * e->cap);
+    lpool_free(e->vals, sizeof(lval*) * e->cap);
+    lpool_free(e, sizeof(lenv));
+}
+
+#define LENV_INDEX_MIN 8
+
+/* Frames with more than a few bindings, the global one in particular, are
+ * indexed by an open addressing hash table of positions in syms and vals.
+ * The arrays themselves keep the bindings in insertion order. */
+unsigned long lenv_hash(lval* k) {
+    return ((size_t)k >> 4) * 2654435761u;
+}
+
+void lenv_index_add(lenv* e, int i) {
+    int mask = e->index_size - 1;
+    int j = lenv_hash(e->syms[i]) & mask;
+    while (e->index[j] != -1) { j = (j + 1) & mask; }
+    e->index[j] = i;
+}
+
+void lenv_reindex(lenv* e) {
+    int size = 16;
+    while (size < e->cap * 2) { size *= 2; }
+
+    lgc_free(e->flags, e->index, sizeof(int) * e->index_size);
+    e->index = lgc_alloc(e->flags, sizeof(int) * size);
+    e->index_size = size;
+    memset(e->index, -1, sizeof(int) * size);
+
     for (int i = 0; i < e->count; ++i) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+        lenv_index_add(e, i);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+int lenv_find(lenv* e, lval* k) {
+    if (e->index) {
+        int mask = e->index_size - 1;
+        for (int j = lenv_hash(k) & mask; e->index[j] != -1; j = (j + 1) & mask) {
+            if (e->syms[e->index[j]] == k) { return e->index[j]; }
         }
+        return -1;
     }
 
-    if (e->par) {
-        return lenv_get(e->par, k);
+    for (int i = 0; i < e->count; ++i) {
+        if (e->syms[i] == k) { return i; }
     }
-    return lval_err("Unbound symbol: '%s'", k->sym);
+    return -1;
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
+/* The binding of k in e itself or in the frames it was built on */
+lval** lenv_slot(lenv* e, lval* k) {
+    for (; e; e = e->outer) {
+        int i = lenv_find(e, k);
+        if (i != -1) { return &e->vals[i]; }
+    }
+    return NULL;
+}
 
-    for (int i = 0; i < n->count; ++i) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+lval* lenv_get(lenv* e, lval* k) {
+    for (; e; e = e->par) {
+        lval** v = lenv_slot(e, k);
+        if (v) { return *v; }
     }
+    return lval_err("Unbound symbol: '%s'", k->sym);
+}
 
+/* A new frame with room for cap bindings, built on the bindings of outer
+ * when there is one. Those stay in outer, which is shared by every frame
+ * built on it and never written to again, so it is not copied. base counts
+ * the bindings in the outer frames, the slots of the new ones follow. */
+lenv* lenv_frame(lenv* outer, int cap) {
+    lenv* n = lenv_new();
+    n->cap = cap;
+    n->syms = lgc_alloc(n->flags, sizeof(lval*) * cap);
+    n->vals = lgc_alloc(n->flags, sizeof(lval*) * cap);
+    if (outer) {
+        n->outer = outer;
+        n->base = outer->base + outer->count;
+    }
     return n;
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    lgc_remember_env(e, v);
+
+    if (e != gc.root) { k->flags |= LSYM_LOCAL; }
+    if (k->flags & LSYM_FOLDED) {
+        k->flags &= ~LSYM_FOLDED;
+        vm.version++;
+    }
+
+    int i = lenv_find(e, k);
+    if (i != -1) {
+        e->vals[i] = v;
+        return;
+    }
+
+    if (e->count == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 4;
+        e->vals = lgc_realloc(e->flags, e->vals,
+            sizeof(lval*) * e->count, sizeof(lval*) * cap);
+        e->syms = lgc_realloc(e->flags, e->syms,
+            sizeof(lval*) * e->count, sizeof(lval*) * cap);
+        e->cap = cap;
     }
 
+    e->vals[e->count] = v;
+    e->syms[e->count] = k;
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = dupstr(k->sym);
-    
+    if (e->index && e->count * 2 <= e->index_size) {
+        lenv_index_add(e, e->count - 1);
+    } else if (e->count >= LENV_INDEX_MIN) {
+        lenv_reindex(e);
+    }
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -139,222 +596,500 @@ void lenv_def(lenv* e, lval* k, lval* v) {
     lenv_put(e, k, v);
 }
 
+lval* lval_new(int type) {
+    lval* v = lgc_bump(lval_size(type));
+    v->type = type;
+    v->flags = LGC_YOUNG;
+    v->next = NULL;
+    return v;
+}
+
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    if (x >= LFIX_MIN && x <= LFIX_MAX) {
+        return (lval*)(((size_t)x << 1) | 1);
+    }
+
+    lval* v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval* v = lval_new(LVAL_ERR);
 
     va_list va;
     va_start(va, fmt);
 
-    const int size = 512;
-    v->err = malloc(size);
-    vsnprintf(v->err, size -1, fmt, va);
-
-    v->err = realloc(v->err, strlen(v->err) + 1);
+    char err[512];
+    vsnprintf(err, sizeof(err) -1, fmt, va);
+    v->err = lgc_strdup(v->flags, err);
 
     va_end(va);
     return v;
 }
 
-lval* lval_sym(char *sym) {
-    lval* v = malloc(sizeof(lval));
+/* Symbols are interned, there is a single value for every name so
+ * environments can compare them by identity. They are allocated outside
+ * the collected heap and live as long as the program. Creating them
+ * already marked keeps the collector from ever looking at them. */
+typedef struct {
+    int count;
+    int size;
+    lval** items;
+} lsymtab;
+
+lsymtab symtab;
+
+lval* lsym_if;
+lval* lsym_amp;
+
+unsigned long lsym_hash(const char* s, int len) {
+    unsigned long h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+void lsymtab_grow(void) {
+    int size = symtab.size ? symtab.size * 2 : 256;
+    lval** items = calloc(size, sizeof(lval*));
+
+    for (int i = 0; i < symtab.size; ++i) {
+        lval* x = symtab.items[i];
+        if (!x) { continue; }
+
+        unsigned long h = lsym_hash(x->sym, strlen(x->sym));
+        int j = h & (size - 1);
+        while (items[j]) { j = (j + 1) & (size - 1); }
+        items[j] = x;
+    }
+
+    free(symtab.items);
+    symtab.items = items;
+    symtab.size = size;
+}
+
+lval* lval_sym_n(const char* sym, int len) {
+    if (symtab.count * 2 >= symtab.size) { lsymtab_grow(); }
+
+    int i = lsym_hash(sym, len) & (symtab.size - 1);
+    while (symtab.items[i]) {
+        lval* x = symtab.items[i];
+        if (strncmp(x->sym, sym, len) == 0 && x->sym[len] == '\0') {
+            return x;
+        }
+        i = (i + 1) & (symtab.size - 1);
+    }
+
+    lval* v = lpool_alloc(lval_size(LVAL_SYM));
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(sym) + 1);
-    strcpy(v->sym, sym);
+    v->flags = LGC_MARK;
+    v->next = NULL;
+    v->sym = lpool_alloc(len + 1);
+    memcpy(v->sym, sym, len);
+    v->sym[len] = '\0';
+
+    symtab.items[i] = v;
+    symtab.count++;
     return v;
 }
 
+lval* lval_sym(char* sym) {
+    return lval_sym_n(sym, strlen(sym));
+}
+
+void lsym_init(void) {
+    lsym_if = lval_sym("if");
+    lsym_amp = lval_sym("&");
+}
+
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_new(LVAL_SEXPR);
     v->count = 0;
+    v->cap = 0;
     v->cell = NULL;
+    v->base = NULL;
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_new(LVAL_QEXPR);
     v->count = 0;
+    v->cap = 0;
     v->cell = NULL;
+    v->base = NULL;
     return v;
 }
 
-lval* lval_builtin(lbuiltin builtin) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+lval* lval_builtin(lbuiltin builtin, int op) {
+    lval* v = lval_new(LVAL_FUN);
     v->builtin = builtin;
+    v->op = op;
     return v;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+lval* lval_fun(lcode* code, lenv* env, int bound) {
+    lval* v = lval_new(LVAL_FUN);
 
     v->builtin = NULL;
-    v->env = lenv_new();
-    v->formals = formals;
-    v->body = body;
+    v->env = env;
+    v->code = code;
+    v->bound = bound;
 
     return v;
 }
 
-void lval_del(lval* v) {
-    if (v == NULL) return;
+lval* lval_lambda(lval* formals, lval* body) {
+    return lval_fun(lval_compile_lambda(formals, body), NULL, 0);
+}
 
+void lval_free(lval* v) {
     switch (v->type) {
         case LVAL_NUM: break;
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+        case LVAL_ERR: lpool_free(v->err, strlen(v->err) + 1); break;
+        case LVAL_STR: lpool_free(v->str, strlen(v->str) + 1); break;
         case LVAL_SEXPR: /* Fall through */
-        case LVAL_QEXPR: 
-            for (int i = 0; i < v->count; ++i) {
-                lval_del(v->cell[i]);
-            }
-
-            free(v->cell);
-            break;
-        case LVAL_FUN:
-            if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
-            }
+        case LVAL_QEXPR:
+        case LVAL_CELLS:
+            if (!v->base) { lpool_free(v->cell, sizeof(lval*) * v->cap); }
             break;
         default: break;
     }
 
-    free(v);
+    lpool_free(v, lval_size(v->type));
 }
 
-lval* lval_read_num(mpc_ast_t* ast) {
-    errno = 0;
-    long x = strtol(ast->contents, NULL, 10);
-    return errno != ERANGE ? 
-        lval_num(x) : lval_err("Invalid number %s", ast->contents);
+/* The reader scans source text once, building values as it goes. The
+ * grammar is the one mpc used to be given:
+ *
+ *   number : /-?[0-9]+/
+ *   symbol : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/
+ *   sexpr  : '(' <expr>* ')'
+ *   qexpr  : '{' <expr>* '}'
+ *   expr   : <number> | <symbol> | <sexpr> | <qexpr>
+ *   lispy  : /^/ <expr>* /$/
+ *
+ * with whitespace allowed between tokens. An expression may also be a
+ * string, which mpc never read: text between double quotes, where a
+ * backslash escapes the next character and \n and \t stand for a newline
+ * and a tab. The text need not be null terminated, it ends at end.
+ * Symbols are interned straight from the text, so it can be a mapping of
+ * a file. err is set on a syntax error. line and col give the position of
+ * start, for errors. */
+typedef struct {
+    char* name;
+    char* start;
+    char* end;
+    char* p;
+    lval* err;
+    int line;
+    int col;
+} lreader;
+
+int lread_symbol_char(char c) {
+    return isalnum((unsigned char)c) || (c && strchr("_+-*/\\=<>!&", c));
 }
 
-lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
-    return v;
+/* Moves the start of r up to p, keeping count of the line and column
+ * it is at */
+void lread_advance(lreader* r, char* p) {
+    for (; r->start < p; r->start++) {
+        if (*r->start == '\n') {
+            r->line++;
+            r->col = 1;
+        } else {
+            r->col++;
+        }
+    }
 }
 
-lval* lval_read(mpc_ast_t* ast) {
-    if (strstr(ast->tag, "number")) { return lval_read_num(ast); }
-    if (strstr(ast->tag, "symbol")) { return lval_sym(ast->contents); }
+/* An error at the current position, reported the way mpc did */
+lval* lread_err(lreader* r, char* expected) {
+    lreader at = *r;
+    lread_advance(&at, r->p);
 
-    lval* x = NULL;
-    if (strcmp(ast->tag, ">") == 0 || strstr(ast->tag, "sexpr")) { x = lval_sexpr(); }
-    if (strstr(ast->tag, "qexpr")) { x = lval_qexpr(); }
+    if (r->p == r->end) {
+        return lval_err("%s:%d:%d: error: expected %s at end of input",
+            r->name, at.line, at.col, expected);
+    }
+    return lval_err("%s:%d:%d: error: expected %s at '%c'",
+        r->name, at.line, at.col, expected, *r->p);
+}
 
-    for (int i = 0; i < ast->children_num; ++i) {
-        if(strcmp(ast->children[i]->contents, "(") == 0) { continue; }
-        if(strcmp(ast->children[i]->contents, ")") == 0) { continue; }
-        if(strcmp(ast->children[i]->contents, "{") == 0) { continue; }
-        if(strcmp(ast->children[i]->contents, "}") == 0) { continue; }
-        if(strcmp(ast->children[i]->tag, "regex") == 0) { continue; }
-        x = lval_add(x, lval_read(ast->children[i]));
+lval* lread_num(lreader* r) {
+    char* start = r->p;
+    int neg = *r->p == '-';
+    if (neg) { r->p++; }
+
+    /* Accumulated on the negative side, which holds one more value */
+    long x = 0;
+    int overflow = 0;
+    for (; r->p < r->end && isdigit((unsigned char)*r->p); r->p++) {
+        int d = *r->p - '0';
+        if (overflow || x < (LONG_MIN + d) / 10) {
+            overflow = 1;
+        } else {
+            x = x * 10 - d;
+        }
     }
 
-    return x;
+    if (overflow || (!neg && x == LONG_MIN)) {
+        return lval_err("Invalid number %.*s", (int)(r->p - start), start);
+    }
+    return lval_num(neg ? x : -x);
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; ++i) {
-        lval_print(v->cell[i]);
+/* Reads a string literal, or returns NULL if it is not terminated */
+lval* lread_str(lreader* r) {
+    int len = 0;
+    char* q = r->p + 1;
+    for (; q < r->end && *q != '"' && *q; ++q, ++len) {
+        if (*q == '\\' && q + 1 < r->end && q[1]) { q++; }
+    }
+    if (q == r->end || !*q) {
+        r->p = q;
+        return NULL;
+    }
+
+    lval* v = lval_new(LVAL_STR);
+    v->str = lgc_alloc(v->flags, len + 1);
 
-        if (i != (v->count -1)) {
-            putchar(' ');
+    char* s = v->str;
+    for (char* c = r->p + 1; c < q; ++c) {
+        if (*c != '\\') {
+            *s++ = *c;
+            continue;
+        }
+        switch (*++c) {
+            case 'n': *s++ = '\n'; break;
+            case 't': *s++ = '\t'; break;
+            default: *s++ = *c; break;
         }
     }
-    putchar(close);
+    *s = '\0';
+
+    r->p = q + 1;
+    return v;
 }
 
-void lval_print(lval* v) {
-    switch(v->type) {
-        case LVAL_NUM: printf("%ld", v->num); break;
-        case LVAL_ERR: printf("Error %s", v->err); break;
-        case LVAL_SYM: printf("%s", v->sym); break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-        case LVAL_FUN: 
-            if (v->builtin) {
-                printf("<function>");
-            } else {
-                printf("(\\");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
-            }
-            break;
-        default: printf("Unknown return type: %d", v->type); break;
+/* Makes room for n more cells, doubling the capacity as often as needed
+ * so a list built one cell at a time is copied a constant number of
+ * times on average. */
+void lval_reserve(lval* v, int n) {
+    if (v->count + n <= v->cap) { return; }
+
+    int cap = v->cap ? v->cap * 2 : 4;
+    while (cap < v->count + n) { cap *= 2; }
+    if (v->base) {
+        lval** cell = lgc_alloc(v->flags, sizeof(lval*) * cap);
+        memcpy(cell, v->cell, sizeof(lval*) * v->count);
+        v->cell = cell;
+        v->base = NULL;
+    } else {
+        v->cell = lgc_realloc(v->flags, v->cell,
+            sizeof(lval*) * v->cap, sizeof(lval*) * cap);
     }
+    v->cap = cap;
 }
 
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+/* A Q-Expression of the n cells of v from i on, sharing them with v */
+lval* lval_slice(lval* v, int i, int n) {
+    lval* x = lval_qexpr();
+    if (n == 0) { return x; }
+
+    x->count = n;
+    x->cell = v->cell + i;
+    x->base = v->base ? v->base : v;
+    return x;
+}
 
-lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+lval* lval_add(lval* v, lval* x) {
+    lval_reserve(v, 1);
+    lgc_remember(v, x);
+    v->cell[v->count++] = x;
+    return v;
+}
 
-    switch(v->type) {
-        case LVAL_NUM: x->num = v->num; break;
-        case LVAL_ERR: x->err = dupstr(v->err); break;
-        case LVAL_SYM: x->sym = dupstr(v->sym); break;
-        case LVAL_SEXPR: /* Fall through */
-        case LVAL_QEXPR: 
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for (int i = 0; i < x->count; ++i) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
+/* Reads the next expression in r. Returns NULL once only whitespace is
+ * left, or on a syntax error with r->err set. */
+lval* lread_expr(lreader* r) {
+    lval* x = NULL;
+    lval* done = NULL;
+    lstack open = { 0 };
+
+    while (!done && !r->err) {
+        while (r->p < r->end && isspace((unsigned char)*r->p)) { r->p++; }
+
+        char* close = !x ? "expression or end of input"
+            : x->type == LVAL_SEXPR ? "expression or ')'" : "expression or '}'";
+        if (r->p == r->end) {
+            if (x) { r->err = lread_err(r, close); }
             break;
-        case LVAL_FUN: 
-            if (v->builtin) {
-                x->builtin = v->builtin;
+        }
+
+        lval* v = NULL;
+        char c = *r->p;
+        if (c == '(' || c == '{') {
+            lval* l = c == '(' ? lval_sexpr() : lval_qexpr();
+            if (x) { lval_add(x, l); }
+            lstack_push(&open, x);
+            x = l;
+            r->p++;
+        } else if (c == ')' || c == '}') {
+            if (!x || (c == ')') != (x->type == LVAL_SEXPR)) {
+                r->err = lread_err(r, close);
             } else {
-                x->builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
+                v = x;
+                x = lstack_pop(&open);
+                r->p++;
+                if (!x) { done = v; }
             }
-            break;
-        default: printf("Unknown type '%d', copy might be incomplete", v->type); break;
+        } else if (isdigit((unsigned char)c) || (c == '-'
+            && r->p + 1 < r->end && isdigit((unsigned char)r->p[1]))) {
+            v = lread_num(r);
+            if (x) { lval_add(x, v); } else { done = v; }
+        } else if (lread_symbol_char(c)) {
+            char* start = r->p;
+            while (r->p < r->end && lread_symbol_char(*r->p)) { r->p++; }
+            v = lval_sym_n(start, r->p - start);
+            if (x) { lval_add(x, v); } else { done = v; }
+        } else if (c == '"') {
+            v = lread_str(r);
+            if (!v) {
+                r->err = lread_err(r, "'\"'");
+            } else if (x) {
+                lval_add(x, v);
+            } else {
+                done = v;
+            }
+        } else {
+            r->err = lread_err(r, close);
+        }
     }
-    return x;
+
+    free(open.items);
+    return done;
 }
 
-lval* lval_pop(lval* v, int i) {
-    lval* x = v->cell[i];
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - i - 1));
-    v->count--;
-    v->cell = realloc(v->cell, sizeof(lval) * v->count);
-    return x;
+/* The end of the line r is on, at its newline or the end of the text,
+ * when only spaces are left before it, or NULL. */
+char* lread_eol(lreader* r) {
+    char* p = r->p;
+    while (p < r->end && *p != '\n' && isspace((unsigned char)*p)) { p++; }
+    return p == r->end || *p == '\n' ? p : NULL;
 }
 
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+/* Reads every expression left in r into an S-Expression, or returns the
+ * first syntax error. */
+lval* lval_read(lreader* r) {
+    lval* x = lval_sexpr();
+    lval* v;
+    while ((v = lread_expr(r))) { lval_add(x, v); }
+    return r->err ? r->err : x;
+}
+
+/* Prints a string the way the reader would read it back */
+void lval_print_str(lval* v) {
+    putchar('"');
+    for (char* c = v->str; *c; ++c) {
+        switch (*c) {
+            case '"': printf("\\\""); break;
+            case '\\': printf("\\\\"); break;
+            case '\n': printf("\\n"); break;
+            case '\t': printf("\\t"); break;
+            default: putchar(*c); break;
+        }
+    }
+    putchar('"');
+}
+
+/* A list being printed and the position reached in it */
+typedef struct {
+    lval* v;
+    int i;
+    char* close;
+} lcursor;
+
+void lval_print(lval* v) {
+    int count = 0;
+    int size = 0;
+    lcursor* s = NULL;
+
+    while (1) {
+        if (v) {
+            char* open = NULL;
+            char* close = NULL;
+            lval* list = v;
+
+            switch (lval_type(v)) {
+                case LVAL_NUM: printf("%ld", lval_number(v)); break;
+                case LVAL_ERR: printf("Error %s", v->err); break;
+                case LVAL_SYM: printf("%s", v->sym); break;
+                case LVAL_STR: lval_print_str(v); break;
+                case LVAL_SEXPR: open = "("; close = ")"; break;
+                case LVAL_QEXPR: open = "{"; close = "}"; break;
+                case LVAL_FUN:
+                    if (v->builtin) {
+                        printf("<function>");
+                        break;
+                    }
+
+                    printf("(\\{");
+                    lval* formals = v->code->formals;
+                    for (int i = v->bound; i < formals->count; ++i) {
+                        printf("%s", formals->cell[i]->sym);
+                        if (i != (formals->count -1)) {
+                            putchar(' ');
+                        }
+                    }
+                    printf("} ");
+                    open = "{";
+                    close = "})";
+                    list = v->code->body;
+                    break;
+                default: printf("Unknown return type: %d", v->type); break;
+            }
+
+            if (open) {
+                fputs(open, stdout);
+                if (count == size) {
+                    size = size ? size * 2 : 16;
+                    s = realloc(s, sizeof(lcursor) * size);
+                }
+                s[count].v = list;
+                s[count].i = 0;
+                s[count].close = close;
+                count++;
+            }
+            v = NULL;
+        }
+
+        if (!count) { break; }
+
+        lcursor* c = &s[count-1];
+        if (c->i == c->v->count) {
+            fputs(c->close, stdout);
+            count--;
+            continue;
+        }
+
+        if (c->i > 0) { putchar(' '); }
+        v = c->v->cell[c->i++];
+    }
+
+    free(s);
 }
 
+void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+
 char* ltype_name(int t) {
     switch (t) {
         case LVAL_FUN: return "Function";
         case LVAL_NUM: return "Number";
         case LVAL_ERR: return "Error";
         case LVAL_SYM: return "Symbol";
+        case LVAL_STR: return "String";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
         default: return "Unknown";
@@ -362,230 +1097,597 @@ char* ltype_name(int t) {
 }
 
 
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
-
-    lval* v = lval_take(a, 0);
-    while(v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
+lval* builtin_if(lenv* e, lval* a);
+
+lcode* lcode_new(void) {
+    lcode* c = lpool_alloc(sizeof(lcode));
+    c->next = gc.codes;
+    gc.codes = c;
+    lgc_count();
+
+    c->epoch = 0;
+    c->version = vm.version;
+    c->count = 0;
+    c->ops_size = 0;
+    c->ops = NULL;
+    c->nconsts = 0;
+    c->consts_size = 0;
+    c->consts = NULL;
+    c->formals = NULL;
+    c->body = NULL;
+    return c;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
-
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+void lcode_free(lcode* c) {
+    lpool_free(c->consts, sizeof(lval*) * c->consts_size);
+    lpool_free(c->ops, sizeof(int) * c->ops_size);
+    lpool_free(c, sizeof(lcode));
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+int lcode_emit(lcode* c, int op) {
+    if (c->count == c->ops_size) {
+        int size = c->ops_size ? c->ops_size * 2 : 8;
+        c->ops = lpool_realloc(c->ops,
+            sizeof(int) * c->ops_size, sizeof(int) * size);
+        c->ops_size = size;
+    }
+    c->ops[c->count++] = op;
+    return c->count-1;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+int lcode_const(lcode* c, lval* v) {
+    if (c->nconsts == c->consts_size) {
+        int size = c->consts_size ? c->consts_size * 2 : 4;
+        c->consts = lpool_realloc(c->consts,
+            sizeof(lval*) * c->consts_size, sizeof(lval*) * size);
+        c->consts_size = size;
+    }
+    c->consts[c->nconsts++] = v;
+    return c->nconsts-1;
+}
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+int lcode_is_if(lval* v) {
+    return v->count == 4
+        && v->cell[0] == lsym_if
+        && lval_type(v->cell[2]) == LVAL_QEXPR
+        && lval_type(v->cell[3]) == LVAL_QEXPR;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT_NUM_ARGS("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+/* Position of the formal k in the frame of a call to the lambda compiled
+ * into c, or -1. Formals are bound in order, skipping '&'. */
+int lcode_slot(lcode* c, lval* k) {
+    if (!c->formals) { return -1; }
 
-    for (int i = 0; i < a->cell[0]->count; ++i) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-            "Cannot define non-symbol. Expected %s, got %s",
-            ltype_name(LVAL_SYM), ltype_name(a->cell[0]->cell[i]->type));
+    int slot = 0;
+    for (int i = 0; i < c->formals->count; ++i) {
+        if (c->formals->cell[i] == lsym_amp) { continue; }
+        if (c->formals->cell[i] == k) { return slot; }
+        slot++;
     }
-
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
-
-    return lval_lambda(formals, body);
+    return -1;
 }
 
-lval* lval_join(lenv* e, lval* x, lval* y) {
-    while(y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+/* The builtin k names for the compiler, when it is bound globally and can't
+ * be shadowed by a local binding. */
+lval* lcode_builtin(lcode* c, lval* k) {
+    if (lval_type(k) != LVAL_SYM || (k->flags & LSYM_LOCAL)
+        || lcode_slot(c, k) != -1) {
+        return NULL;
     }
 
-    lval_del(y);
-    return x;
+    int i = lenv_find(gc.root, k);
+    if (i == -1) { return NULL; }
+
+    lval* f = gc.root->vals[i];
+    return lval_type(f) == LVAL_FUN && f->builtin ? f : NULL;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-    for (int i = 0; i  < a->count; ++i) {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+#define LCODE_FOLD_DEPTH 32
+
+/* The value of v when it only applies arithmetic and comparison builtins
+ * to numbers, or NULL. The names it relies on are flagged as folded. */
+lval* lcode_fold(lcode* c, lval* v, int depth) {
+    if (lval_type(v) == LVAL_NUM) { return v; }
+    if (lval_type(v) != LVAL_SEXPR || v->count < 2
+        || depth == LCODE_FOLD_DEPTH) {
+        return NULL;
     }
 
-    lval* x = lval_pop(a, 0);
+    lval* f = lcode_builtin(c, v->cell[0]);
+    if (!f || f->op == LOP_NONE) { return NULL; }
 
-    while(a->count) {
-        x = lval_join(e, x, lval_pop(a, 0));
+    lval* a = lval_sexpr();
+    for (int i = 1; i < v->count; ++i) {
+        lval* x = lcode_fold(c, v->cell[i], depth + 1);
+        if (!x) { return NULL; }
+        lval_add(a, x);
     }
 
-    lval_del(a);
-    return x;
+    lval* r = f->builtin(gc.root, a);
+    if (lval_type(r) == LVAL_ERR) { return NULL; }
+
+    v->cell[0]->flags |= LSYM_FOLDED;
+    return r;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+enum { LTASK_EXPR, LTASK_LIST, LTASK_CALL, LTASK_IF, LTASK_ELSE, LTASK_END,
+    LTASK_GUARD, LTASK_PATCH };
+
+/* A pending step of the compiler */
+typedef struct {
+    int kind;
+    lval* v;
+    int tail;
+    int at;
+} ltask;
+
+typedef struct {
+    int count;
+    int size;
+    ltask* items;
+} ltasks;
+
+void ltasks_push(ltasks* s, int kind, lval* v, int tail, int at) {
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 64;
+        s->items = realloc(s->items, sizeof(ltask) * s->size);
+    }
+    ltask* t = &s->items[s->count++];
+    t->kind = kind;
+    t->v = v;
+    t->tail = tail;
+    t->at = at;
+}
+
+/* Compiles v, or its cells as an S-Expression whatever its type when list
+ * is set. A call in tail position reuses the frame of the running code. */
+void lcode_gen(lcode* c, lval* v, int list, int tail) {
+    ltasks s = { 0, 0, NULL };
+    ltasks_push(&s, list ? LTASK_LIST : LTASK_EXPR, v, tail, 0);
+
+    while (s.count) {
+        ltask t = s.items[--s.count];
+        v = t.v;
+
+        switch (t.kind) {
+            case LTASK_EXPR:
+                switch (lval_type(v)) {
+                    case LVAL_SYM: {
+                        int slot = lcode_slot(c, v);
+                        if (slot != -1) {
+                            lcode_emit(c, OP_LOCAL);
+                            lcode_emit(c, slot);
+                            lcode_emit(c, lcode_const(c, v));
+                        } else {
+                            lcode_emit(c, OP_LOOKUP);
+                            lcode_emit(c, lcode_const(c, v));
+                            lcode_emit(c, 0);
+                        }
+                        break;
+                    }
+                    case LVAL_SEXPR:
+                        ltasks_push(&s, LTASK_LIST, v, t.tail, 0);
+                        break;
+                    default:
+                        lcode_emit(c, OP_CONST);
+                        lcode_emit(c, lcode_const(c, v));
+                        break;
+                }
+                break;
+
+            /* Calls folded into a constant are compiled twice. OP_GUARD
+             * takes the constant until a name it relies on is bound again,
+             * a set at marks the plain version. An 'if' with a constant
+             * condition is compiled once, with a jump past the plain
+             * version into the branch it takes. */
+            case LTASK_LIST:
+                if (v->count >= 2 && !t.at) {
+                    lval* k = lcode_fold(c, v, 0);
+                    lval* cond = NULL;
+                    if (!k && lcode_is_if(v)) {
+                        lval* f = lcode_builtin(c, v->cell[0]);
+                        if (f && f->builtin == builtin_if) {
+                            cond = lcode_fold(c, v->cell[1], 0);
+                        }
+                    }
+
+                    if (k) {
+                        lcode_emit(c, OP_GUARD);
+                        int guard_at = lcode_emit(c, 0);
+                        ltasks_push(&s, LTASK_GUARD, v, t.tail, guard_at);
+                        lcode_emit(c, OP_CONST);
+                        lcode_emit(c, lcode_const(c, k));
+                        break;
+                    }
+
+                    if (cond) {
+                        lcode_emit(c, OP_GUARD);
+                        int guard_at = lcode_emit(c, 0);
+                        lcode_emit(c, OP_JUMP);
+                        int jump_at = lcode_emit(c, 0);
+                        c->ops[guard_at] = c->count;
+
+                        v->cell[0]->flags |= LSYM_FOLDED;
+                        ltasks_push(&s, LTASK_IF, v, t.tail,
+                            lval_number(cond) ? jump_at : -jump_at);
+                        ltasks_push(&s, LTASK_EXPR, v->cell[1], 0, 0);
+                        ltasks_push(&s, LTASK_EXPR, v->cell[0], 0, 0);
+                        break;
+                    }
+                }
+
+                if (v->count == 0) {
+                    lcode_emit(c, OP_CONST);
+                    lcode_emit(c, lcode_const(c, lval_sexpr()));
+                } else if (v->count == 1) {
+                    ltasks_push(&s, LTASK_EXPR, v->cell[0], t.tail, 0);
+                } else if (lcode_is_if(v)) {
+                    ltasks_push(&s, LTASK_IF, v, t.tail, 0);
+                    ltasks_push(&s, LTASK_EXPR, v->cell[1], 0, 0);
+                    ltasks_push(&s, LTASK_EXPR, v->cell[0], 0, 0);
+                } else {
+                    ltasks_push(&s, LTASK_CALL, v, t.tail, 0);
+                    for (int i = v->count - 1; i >= 0; --i) {
+                        ltasks_push(&s, LTASK_EXPR, v->cell[i], 0, 0);
+                    }
+                }
+                break;
+
+            case LTASK_CALL:
+                lcode_emit(c, t.tail ? OP_TAILCALL : OP_CALL);
+                lcode_emit(c, v->count - 1);
+                break;
+
+            /* Branches of an 'if' with literal Q-Expressions are compiled
+             * inline. OP_IF falls back to an ordinary call when 'if' is not
+             * the builtin. A positive at is the jump to patch with the start
+             * of the then branch, a negative one with that of the else. */
+            case LTASK_IF: {
+                lcode_emit(c, OP_IF);
+                lcode_emit(c, lcode_const(c, v->cell[2]));
+                lcode_emit(c, lcode_const(c, v->cell[3]));
+                int else_at = lcode_emit(c, 0);
+                int end_at = lcode_emit(c, 0);
+                if (t.at > 0) { c->ops[t.at] = c->count; }
+
+                ltasks_push(&s, LTASK_END, v, t.tail, end_at);
+                ltasks_push(&s, LTASK_LIST, v->cell[3], t.tail, 0);
+                if (t.at < 0) { ltasks_push(&s, LTASK_PATCH, v, 0, -t.at); }
+                ltasks_push(&s, LTASK_ELSE, v, t.tail, else_at);
+                ltasks_push(&s, LTASK_LIST, v->cell[2], t.tail, 0);
+                break;
+            }
+
+            case LTASK_ELSE:
+                lcode_emit(c, OP_JUMP);
+                lcode_emit(c, 0);
+                c->ops[t.at] = c->count;
+                break;
+
+            /* The else position is stored right before the end position,
+             * and the jump out of the then branch right before the else */
+            case LTASK_END:
+                c->ops[c->ops[t.at - 1] - 1] = c->count;
+                c->ops[t.at] = c->count;
+                break;
+
+            case LTASK_GUARD:
+                lcode_emit(c, OP_JUMP);
+                ltasks_push(&s, LTASK_PATCH, v, t.tail, lcode_emit(c, 0));
+                ltasks_push(&s, LTASK_LIST, v, t.tail, 1);
+                c->ops[t.at] = c->count;
+                break;
+
+            case LTASK_PATCH:
+                c->ops[t.at] = c->count;
+                break;
+        }
+    }
+
+    free(s.items);
+}
+
+lcode* lval_compile(lval* v) {
+    lcode* c = lcode_new();
+    lcode_gen(c, v, 0, 1);
+    lcode_emit(c, OP_RET);
+    return c;
+}
+
+lcode* lval_compile_list(lval* v) {
+    lcode* c = lcode_new();
+    lcode_gen(c, v, 1, 1);
+    lcode_emit(c, OP_RET);
+    return c;
+}
+
+/* References to the formals are compiled to their slot in the frame, any
+ * other name is still looked up through the caller's environments. */
+lcode* lval_compile_lambda(lval* formals, lval* body) {
+    lcode* c = lcode_new();
+    c->formals = formals;
+    c->body = body;
+    lcode_gen(c, body, 1, 1);
+    lcode_emit(c, OP_RET);
+    return c;
+}
+
+/* Used by builtins that evaluate an expression in place of their call,
+ * such as 'eval' and 'if'. Rather than nest another VM loop on the C
+ * stack, they return NULL and the VM runs the code left in vm.cont in a
+ * frame of its own, or in the caller's frame for a tail call. */
+lval* lvm_continue(lval* v) {
+    vm.cont = lval_compile_list(v);
+    return NULL;
+}
+
+
+lval* builtin_head(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("head", a, 1);
+    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("head", a, 0);
+
+    lval* v = a->cell[0];
+    return lval_add(lval_qexpr(), v->cell[0]);
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("tail", a, 1);
+    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+
+    lval* v = a->cell[0];
+    return lval_slice(v, 1, v->count - 1);
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+    lval* x = a->cell[0];
+    return lvm_continue(x);
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+    for (int i = 0; i < a->cell[0]->count; ++i) {
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+            "Cannot define non-symbol. Expected %s, got %s",
+            ltype_name(LVAL_SYM), ltype_name(lval_type(a->cell[0]->cell[i])));
+    }
+
+    return lval_lambda(a->cell[0], a->cell[1]);
+}
+
+/* A list of n cells for the caller to fill followed by the cells of y.
+ * Those are shared when they start the cells in use of an LVAL_CELLS base
+ * with room for n more, and otherwise moved to a new one with as much room
+ * again, so a list built by prepending to it is only copied a number of
+ * times logarithmic in its length. */
+lval* lval_prepend(lval* y, int n) {
+    lval* s = y->base;
+    if (!s || s->type != LVAL_CELLS
+        || y->cell != s->cell + s->count || s->count < n) {
+        s = lval_new(LVAL_CELLS);
+        s->cap = (n + y->count) * 2;
+        s->count = s->cap - y->count;
+        s->cell = lgc_alloc(s->flags, sizeof(lval*) * s->cap);
+        s->base = NULL;
+        memcpy(s->cell + s->count, y->cell, sizeof(lval*) * y->count);
+    }
+    s->count -= n;
+
+    lval* x = lval_qexpr();
+    x->count = n + y->count;
+    x->cell = s->cell + s->count;
+    x->base = s;
+    return x;
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+    for (int i = 0; i  < a->count; ++i) {
+        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+    }
+
+    /* Lists are not modified once built, so the last non empty list is
+     * shared by the result and only the cells of the others are copied */
+    int last = -1;
+    int n = 0;
+    for (int i = 0; i < a->count; ++i) {
+        if (!a->cell[i]->count) { continue; }
+        if (last != -1) { n += a->cell[last]->count; }
+        last = i;
+    }
+    if (last == -1) { return lval_qexpr(); }
+    if (n == 0) { return a->cell[last]; }
+
+    lval* x = lval_prepend(a->cell[last], n);
+    lval** cell = x->cell;
+    for (int i = 0; i < last; ++i) {
+        for (int j = 0; j < a->cell[i]->count; ++j) {
+            *cell = a->cell[i]->cell[j];
+            lgc_remember(x->base, *cell++);
+        }
+    }
+
+    return x;
+}
+
+lval* builtin_op(lenv* e, lval* a, int op) {
     for (int i = 0; i < a->count; ++i) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
+        if (lval_type(a->cell[i]) != LVAL_NUM) {
             return lval_err("Cannot operate on non-number type: %s!",
-                ltype_name(a->cell[i]->type));
+                ltype_name(lval_type(a->cell[i])));
         }
     }
 
-    lval* x = lval_pop(a, 0);
+    long x = lval_number(a->cell[0]);
 
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+    if (op == LOP_SUB && a->count == 1) {
+        x = -x;
     }
 
-    while(a->count > 0) {
-        lval* y = lval_pop(a, 0);
+    for (int i = 1; i < a->count; ++i) {
+        long y = lval_number(a->cell[i]);
 
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; } 
-        if (strcmp(op, "*") == 0) { x->num *= y->num; } 
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero!");
+        switch (op) {
+            case LOP_ADD: x += y; break;
+            case LOP_SUB: x -= y; break;
+            case LOP_MUL: x *= y; break;
+            case LOP_DIV:
+                if (y == 0) {
+                    return lval_err("Division by zero!");
+                }
+                x /= y;
                 break;
-            }
-            x-> num /= y->num;
-        } 
-
-        lval_del(y);
+        }
     }
 
-    lval_del(a);
-    return x;
+    return lval_num(x);
 }
 
 lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+    return builtin_op(e, a, LOP_ADD);
 }
 
 lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+    return builtin_op(e, a, LOP_SUB);
 }
 
 lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+    return builtin_op(e, a, LOP_MUL);
 }
 
 lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+    return builtin_op(e, a, LOP_DIV);
 }
 
 int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) {
-        return 0;
-    }
+    lstack s = { 0, 0, NULL };
+    int eq = 1;
 
-    switch (x->type) {
-        case LVAL_NUM:
-            return x->num == y->num;
-        case LVAL_ERR:
-            return strcmp(x->err, y->err) == 0;
-        case LVAL_SYM:
-            return strcmp(x->sym, y->sym) == 0;
-        case LVAL_FUN:
-            if (x->builtin || y->builtin)
-                return x->builtin == y->builtin;
-            return lval_eq(x->formals, y->formals)
-                && lval_eq(x->body, y->body);
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if (x->count != y->count) { 
-                return 0;
-            }
+    lstack_push(&s, x);
+    lstack_push(&s, y);
 
-            for (int i = 0; i < x->count; ++i) {
-                if (!lval_eq(x->cell[i], y->cell[i])) {
-                    return 0;
-                }
-            }
+    while (eq && s.count) {
+        y = lstack_pop(&s);
+        x = lstack_pop(&s);
 
-            return 1;
-        default:
-            printf("Unsupported type in eq");
+        if (lval_type(x) != lval_type(y)) {
+            eq = 0;
             break;
-    }
-    return 0;
-}
+        }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM_ARGS(op, a, 2);
+        switch (lval_type(x)) {
+            case LVAL_NUM:
+                eq = lval_number(x) == lval_number(y);
+                break;
+            case LVAL_ERR:
+                eq = strcmp(x->err, y->err) == 0;
+                break;
+            case LVAL_STR:
+                eq = strcmp(x->str, y->str) == 0;
+                break;
+            case LVAL_SYM:
+                eq = x == y;
+                break;
+            case LVAL_FUN:
+                if (x->builtin || y->builtin) {
+                    eq = x->builtin == y->builtin;
+                    break;
+                }
+                if (x->code->formals->count - x->bound
+                    != y->code->formals->count - y->bound) {
+                    eq = 0;
+                    break;
+                }
 
-    int r = 0;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    } else if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
+                for (int i = 0; i < x->code->formals->count - x->bound; ++i) {
+                    lstack_push(&s, x->code->formals->cell[x->bound + i]);
+                    lstack_push(&s, y->code->formals->cell[y->bound + i]);
+                }
+                lstack_push(&s, x->code->body);
+                lstack_push(&s, y->code->body);
+                break;
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                if (x->count != y->count) {
+                    eq = 0;
+                    break;
+                }
+
+                for (int i = 0; i < x->count; ++i) {
+                    lstack_push(&s, x->cell[i]);
+                    lstack_push(&s, y->cell[i]);
+                }
+                break;
+            default:
+                printf("Unsupported type in eq");
+                eq = 0;
+                break;
+        }
     }
 
-    lval_del(a);
-    return lval_num(r);
+    free(s.items);
+    return eq;
+}
+
+lval* builtin_cmp(lenv* e, lval* a, int op) {
+    LASSERT_NUM_ARGS(lop_name[op], a, 2);
+
+    int r = lval_eq(a->cell[0], a->cell[1]);
+    return lval_num(op == LOP_EQ ? r : !r);
 }
 
 lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+    return builtin_cmp(e, a, LOP_EQ);
 }
 
 lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+    return builtin_cmp(e, a, LOP_NE);
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM_ARGS(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
+lval* builtin_ord(lenv* e, lval* a, int op) {
+    LASSERT_NUM_ARGS(lop_name[op], a, 2);
+    LASSERT_TYPE(lop_name[op], a, 0, LVAL_NUM);
+    LASSERT_TYPE(lop_name[op], a, 1, LVAL_NUM);
 
+    long x = lval_number(a->cell[0]);
+    long y = lval_number(a->cell[1]);
     int r = 0;
 
-    if (strcmp(op, ">") == 0) { 
-        r = (a->cell[0]->num > a->cell[1]->num);
-    } else if (strcmp(op, "<") == 0) { 
-        r = (a->cell[0]->num < a->cell[1]->num);
-    } else if (strcmp(op, ">=") == 0) { 
-        r = (a->cell[0]->num >= a->cell[1]->num);
-    } else if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
+    switch (op) {
+        case LOP_GT: r = x > y; break;
+        case LOP_LT: r = x < y; break;
+        case LOP_GE: r = x >= y; break;
+        case LOP_LE: r = x <= y; break;
     }
 
-    lval_del(a);
     return lval_num(r);
 }
 
 lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+    return builtin_ord(e, a, LOP_GT);
 }
 
 lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+    return builtin_ord(e, a, LOP_LT);
 }
 
 lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+    return builtin_ord(e, a, LOP_GE);
 }
 
 lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+    return builtin_ord(e, a, LOP_LE);
 }
 
 lval* builtin_if(lenv* e, lval* a) {
@@ -594,183 +1696,955 @@ lval* builtin_if(lenv* e, lval* a) {
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
-
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
-    }
-
-    lval_del(a);
-    return x;
+    return lvm_continue(lval_number(a->cell[0]) ? a->cell[1] : a->cell[2]);
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
+lval* builtin_var(lenv* e, lval* a, int op) {
+    char* func = lop_name[op];
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
     lval* syms = a->cell[0];
 
     for (int i = 0; i < syms->count; ++i) {
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+        LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM,
             "Function '%s' cannot define non-symbol type"
             "Expected %s, Got %s",
-            func, ltype_name(LVAL_SYM), ltype_name(syms->cell[i]->type));
+            func, ltype_name(LVAL_SYM), ltype_name(lval_type(syms->cell[i])));
     }
 
     LASSERT(a, (syms->count == a->count -1),
         "Function '%s' cannot define incorrect number of values to symbols"
-        "Expected %s, Got %s",
-        func, a->count -1, syms->count);
+        "Expected %d, Got %d",
+        func, syms->count, a->count -1);
 
     for (int i = 0; i < syms->count; ++i) {
-        if (strcmp(func, "def") == 0) {
+        if (op == LOP_DEF) {
             lenv_def(e, syms->cell[i], a->cell[i+1]);
-        }
-
-        if (strcmp(func, "=") == 0)  {
+        } else {
             lenv_put(e, syms->cell[i], a->cell[i+1]);
         }
     }
 
-    lval_del(a);
     return lval_sexpr();
 }
 
 lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+    return builtin_var(e, a, LOP_DEF);
 }
 
 lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+    return builtin_var(e, a, LOP_PUT);
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->builtin) { return f->builtin(e, a); }
+/* Arguments are ignored, a lone (gc) evaluates to the function itself
+ * so a collection is forced with something like (gc {}). */
+lval* builtin_gc(lenv* e, lval* a) {
+    gc.pending = gc.full = 1;
+    return lval_sexpr();
+}
 
+/* Prints the live and peak block counts of each pool size class in use.
+ * Arguments are ignored like those of 'gc'. */
+lval* builtin_mem(lenv* e, lval* a) {
+    printf("%8s %10s %10s\n", "bytes", "live", "peak");
+    for (int k = 0; k <= LPOOL_CLASSES; ++k) {
+        if (!pool.peak[k]) { continue; }
+
+        if (k == LPOOL_CLASSES) {
+            printf("%8s %10ld %10ld\n", "large", pool.live[k], pool.peak[k]);
+        } else {
+            printf("%8d %10ld %10ld\n", (k + 1) * 8, pool.live[k], pool.peak[k]);
+        }
+    }
+    return lval_sexpr();
+}
+
+/* Binds the arguments a to the formals of f which are not bound yet, in a
+ * fresh frame built on the one holding the bindings f already carries. f
+ * itself is left untouched. Returns the frame, or NULL with *err set on failure.
+ * *bound receives the number of formals bound after the call. */
+lenv* lval_bind(lval* f, lval* a, int* bound, lval** err) {
+    lval* formals = f->code->formals;
     int given = a->count;
-    int total = f->formals->count;
+    int total = formals->count - f->bound;
+    int i = f->bound;
+
+    lenv* frame = lenv_frame(f->env, total);
+    *err = NULL;
 
-    while(a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err(
+    for (int j = 0; j < a->count; ++j) {
+        if (i == formals->count) {
+            *err = lval_err(
                 "Function passed to many arguments. "
                 "Expected %d, got %d.", total, given);
+            break;
         }
 
-        lval* sym = lval_pop(f->formals, 0);
-        if (strcmp(sym->sym, "&") == 0) {
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("Function format invalid."
+        lval* sym = formals->cell[i++];
+        if (sym == lsym_amp) {
+            if (formals->count - i != 1) {
+                *err = lval_err("Function format invalid."
                     "Symbol '&' not followed by single symbol.");
+                break;
             }
 
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+            lval* rest = lval_slice(a, j, a->count - j);
+            lenv_put(frame, formals->cell[i++], rest);
             break;
         }
 
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
+        lenv_put(frame, sym, a->cell[j]);
+    }
 
-        lval_del(sym);
-        lval_del(val);
+    if (!*err && i < formals->count &&
+         formals->cell[i] == lsym_amp) {
+        if (formals->count - i != 2) {
+            *err = lval_err("Function format invalid."
+                    "Symbol '&' not followed by single symbol.");
+        } else {
+            lenv_put(frame, formals->cell[i+1], lval_qexpr());
+            i += 2;
+        }
     }
 
-    lval_del(a);
+    if (*err) { return NULL; }
 
-    if (f->formals->count > 0 &&
-         strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid."
-                    "Symbol '&' not followed by single symbol.");
+    *bound = i;
+    return frame;
+}
+
+/* Copies a young object into the old generation, leaving a forwarding
+ * pointer behind. The copy is queued so its contents get promoted too. */
+lval* lgc_promote(lval* v) {
+    if (LVAL_FIXNUM(v) || !(v->flags & LGC_YOUNG)) { return v; }
+    if (v->flags & LGC_MOVED) { return v->next; }
+
+    lval* x = lpool_alloc(lval_size(v->type));
+    memcpy(x, v, lval_size(v->type));
+    x->flags = 0;
+    x->next = gc.vals;
+    gc.vals = x;
+    gc.count++;
+
+    v->flags |= LGC_MOVED;
+    v->next = x;
+    lstack_push(&gc.grey, x);
+    return x;
+}
+
+lenv* lgc_promote_env(lenv* e) {
+    if (!e || !(e->flags & LGC_YOUNG)) { return e; }
+    if (e->flags & LGC_MOVED) { return e->next; }
+
+    lenv* x = lpool_alloc(sizeof(lenv));
+    *x = *e;
+    x->flags = e->flags & LENV_LEFT;
+    x->next = gc.envs;
+    gc.envs = x;
+    gc.count++;
+
+    e->flags |= LGC_MOVED;
+    e->next = x;
+    lstack_push(&gc.grey_envs, x);
+    return x;
+}
+
+void lgc_promote_code(lcode* c) {
+    if (c->epoch == gc.epoch) { return; }
+    c->epoch = gc.epoch;
+
+    for (int i = 0; i < c->nconsts; ++i) {
+        c->consts[i] = lgc_promote(c->consts[i]);
+    }
+    if (c->formals) { c->formals = lgc_promote(c->formals); }
+    if (c->body) { c->body = lgc_promote(c->body); }
+}
+
+/* Moves the strings and arrays of a freshly promoted value out of the
+ * nursery, promoting whatever it refers to. */
+void lgc_promote_fields(lval* v) {
+    switch (v->type) {
+        case LVAL_ERR: v->err = lgc_strdup(0, v->err); break;
+        case LVAL_STR: v->str = lgc_strdup(0, v->str); break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: {
+            /* The cells of base may not have moved yet, so the offset of
+             * a slice waits in cap until they have */
+            if (v->base) {
+                v->cap = v->cell - v->base->cell;
+                v->base = lgc_promote(v->base);
+                lstack_push(&gc.slices, v);
+                break;
+            }
+
+            lval** cell = lpool_alloc(sizeof(lval*) * v->count);
+            for (int i = 0; i < v->count; ++i) {
+                cell[i] = lgc_promote(v->cell[i]);
+            }
+            v->cell = cell;
+            v->cap = v->count;
+            break;
+        }
+        case LVAL_CELLS: {
+            /* Slices find their cells at the same offsets */
+            lval** cell = lpool_alloc(sizeof(lval*) * v->cap);
+            for (int i = v->count; i < v->cap; ++i) {
+                cell[i] = lgc_promote(v->cell[i]);
+            }
+            v->cell = cell;
+            break;
+        }
+        case LVAL_FUN:
+            if (!v->builtin) {
+                v->env = lgc_promote_env(v->env);
+                lgc_promote_code(v->code);
+            }
+            break;
+        default: break;
+    }
+}
+
+void lgc_promote_env_fields(lenv* e) {
+    lval** syms = lpool_alloc(sizeof(lval*) * e->count);
+    lval** vals = lpool_alloc(sizeof(lval*) * e->count);
+    memcpy(syms, e->syms, sizeof(lval*) * e->count);
+    for (int i = 0; i < e->count; ++i) {
+        vals[i] = lgc_promote(e->vals[i]);
+    }
+    e->syms = syms;
+    e->vals = vals;
+    e->cap = e->count;
+    if (e->index) {
+        int* index = lpool_alloc(sizeof(int) * e->index_size);
+        memcpy(index, e->index, sizeof(int) * e->index_size);
+        e->index = index;
+    }
+    e->par = lgc_promote_env(e->par);
+    e->outer = lgc_promote_env(e->outer);
+}
+
+void lgc_minor(void) {
+    gc.root = lgc_promote_env(gc.root);
+
+    for (int i = 0; i < vm.sp; ++i) {
+        vm.stack[i] = lgc_promote(vm.stack[i]);
+    }
+
+    for (int i = 0; i < vm.fp; ++i) {
+        vm.frames[i].env = lgc_promote_env(vm.frames[i].env);
+        lgc_promote_code(vm.frames[i].code);
+    }
+
+    while (gc.remembered.count) {
+        lval* v = lstack_pop(&gc.remembered);
+        v->flags &= ~LGC_REMEMBERED;
+        int end = v->type == LVAL_CELLS ? v->cap : v->count;
+        for (int i = v->type == LVAL_CELLS ? v->count : 0; i < end; ++i) {
+            v->cell[i] = lgc_promote(v->cell[i]);
+        }
+    }
+
+    while (gc.remembered_envs.count) {
+        lenv* e = lstack_pop(&gc.remembered_envs);
+        e->flags &= ~LGC_REMEMBERED;
+        for (int i = 0; i < e->count; ++i) {
+            e->vals[i] = lgc_promote(e->vals[i]);
         }
+        e->par = lgc_promote_env(e->par);
+        e->outer = lgc_promote_env(e->outer);
+    }
 
-        lval_del(lval_pop(f->formals, 0));
+    while (gc.grey.count || gc.grey_envs.count) {
+        if (gc.grey.count) {
+            lgc_promote_fields(lstack_pop(&gc.grey));
+        } else {
+            lgc_promote_env_fields(lstack_pop(&gc.grey_envs));
+        }
+    }
 
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
+    while (gc.slices.count) {
+        lval* v = lstack_pop(&gc.slices);
+        v->cell = v->base->cell + v->cap;
+        v->cap = 0;
+    }
 
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+    /* Everything left in the nursery is garbage. Keep one chunk, and the
+     * others of the usual size for reuse while a form is evaluated. */
+    while (gc.nursery->next) {
+        lchunk* c = gc.nursery;
+        gc.nursery = c->next;
+        if (gc.arena && c->end - (char*)(c + 1) == LGC_NURSERY_SIZE) {
+            c->next = gc.spare;
+            gc.spare = c;
+        } else {
+            free(c);
+        }
     }
+    gc.nursery->top = (char*)(gc.nursery + 1);
+    gc.young = gc.nursery->end - gc.nursery->top;
+
+    gc.epoch++;
+    if (gc.count > gc.threshold) { gc.full = 1; }
+}
+
+void lgc_push(lval* v) {
+    if (LVAL_FIXNUM(v) || (v->flags & LGC_MARK)) { return; }
+    v->flags |= LGC_MARK;
+    lstack_push(&gc.grey, v);
+}
+
+void lgc_mark_env(lenv* e) {
+    if (!e || (e->flags & LGC_MARK)) { return; }
+    e->flags |= LGC_MARK;
+    lstack_push(&gc.grey_envs, e);
+}
+
+void lgc_mark_code(lcode* c) {
+    if (c->epoch == gc.epoch) { return; }
+    c->epoch = gc.epoch;
 
-    if (f->formals->count == 0) {
-        f->env->par = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    for (int i = 0; i < c->nconsts; ++i) {
+        lgc_push(c->consts[i]);
     }
-    return lval_copy(f);
+    if (c->formals) { lgc_push(c->formals); }
+    if (c->body) { lgc_push(c->body); }
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    for (int i = 0; i < v->count; ++i) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+/* Only runs right after a minor collection, when the nursery is empty. */
+void lgc_mark(void) {
+    lgc_mark_env(gc.root);
+
+    for (int i = 0; i < vm.sp; ++i) {
+        lgc_push(vm.stack[i]);
+    }
+
+    for (int i = 0; i < vm.fp; ++i) {
+        lgc_mark_env(vm.frames[i].env);
+        lgc_mark_code(vm.frames[i].code);
+    }
+
+    while (gc.grey.count || gc.grey_envs.count) {
+        if (gc.grey_envs.count) {
+            lenv* e = lstack_pop(&gc.grey_envs);
+            for (int i = 0; i < e->count; ++i) {
+                lgc_push(e->vals[i]);
+            }
+            lgc_mark_env(e->par);
+            lgc_mark_env(e->outer);
+            continue;
+        }
+
+        lval* v = lstack_pop(&gc.grey);
+        switch (v->type) {
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                /* The cells of a slice are marked with those of its base */
+                if (v->base) {
+                    lgc_push(v->base);
+                    break;
+                }
+                for (int i = 0; i < v->count; ++i) {
+                    lgc_push(v->cell[i]);
+                }
+                break;
+            case LVAL_CELLS:
+                for (int i = v->count; i < v->cap; ++i) {
+                    lgc_push(v->cell[i]);
+                }
+                break;
+            case LVAL_FUN:
+                if (!v->builtin) {
+                    lgc_mark_env(v->env);
+                    lgc_mark_code(v->code);
+                }
+                break;
+            default: break;
+        }
+    }
+}
+
+void lgc_sweep(void) {
+    gc.count = 0;
+
+    lval** v = &gc.vals;
+    while (*v) {
+        lval* x = *v;
+        if (x->flags & LGC_MARK) {
+            x->flags &= ~LGC_MARK;
+            v = &x->next;
+            gc.count++;
+        } else {
+            *v = x->next;
+            lval_free(x);
+        }
+    }
+
+    lenv** e = &gc.envs;
+    while (*e) {
+        lenv* x = *e;
+        if (x->flags & LGC_MARK) {
+            x->flags &= ~LGC_MARK;
+            e = &x->next;
+            gc.count++;
+        } else {
+            *e = x->next;
+            lenv_free(x);
+        }
+    }
+
+    lcode** c = &gc.codes;
+    while (*c) {
+        lcode* x = *c;
+        if (x->epoch == gc.epoch) {
+            c = &x->next;
+            gc.count++;
+        } else {
+            *c = x->next;
+            lcode_free(x);
+        }
+    }
+}
+
+void lgc_collect(void) {
+    lgc_minor();
+
+    if (gc.full) {
+        lgc_mark();
+        lgc_sweep();
+
+        gc.epoch++;
+        gc.full = 0;
+        gc.threshold = gc.count * 2 > LGC_MIN_THRESHOLD
+            ? gc.count * 2 : LGC_MIN_THRESHOLD;
+    }
+
+    gc.pending = 0;
+}
+
+/* Arenas nest, as a file loaded from a form evaluates its own forms in
+ * arenas of their own. */
+void lgc_arena_begin(void) {
+    gc.arena++;
+}
+
+/* Only called once a form is done, when what is live is reachable from
+ * the roots. The spare chunks are kept until the outermost arena ends. */
+void lgc_arena_end(void) {
+    gc.arena--;
+    lgc_collect();
+
+    while (!gc.arena && gc.spare) {
+        lchunk* c = gc.spare;
+        gc.spare = c->next;
+        free(c);
+    }
+}
+
+void lvm_push(lval* v) {
+    if (vm.sp == vm.stack_size) {
+        vm.stack_size = vm.stack_size ? vm.stack_size * 2 : 256;
+        vm.stack = realloc(vm.stack, sizeof(lval*) * vm.stack_size);
+    }
+    vm.stack[vm.sp++] = v;
+}
+
+lval* lvm_pop(void) {
+    return vm.stack[--vm.sp];
+}
+
+void lvm_push_frame(lcode* c, lenv* e, int owner, size_t size) {
+    if (vm.fp == vm.frames_size) {
+        vm.frames_size = vm.frames_size ? vm.frames_size * 2 : 64;
+        vm.frames = realloc(vm.frames, sizeof(lframe) * vm.frames_size);
+    }
+    lframe* fr = &vm.frames[vm.fp++];
+    fr->code = c;
+    fr->ip = 0;
+    fr->env = e;
+    fr->owner = owner;
+    fr->size = size;
+    vm.heap += size;
+}
+
+/* The heap bytes of a call's environment, when it has one, and its list
+ * of n arguments */
+size_t lvm_call_size(lenv* e, int n) {
+    size_t size = lval_size(LVAL_SEXPR) + sizeof(lval*) * n;
+    if (e) { size += sizeof(lenv) + 2 * sizeof(lval*) * e->cap; }
+    return size;
+}
+
+int lvm_exhausted(void) {
+    return sizeof(lframe) * vm.fp + sizeof(lval*) * vm.sp + vm.heap
+        >= LVM_STACK_LIMIT;
+}
+
+lval* lvm_exhausted_err(void) {
+    return lval_err("Maximum evaluation depth exceeded! "
+        "Stack limit is %ld bytes", (long)LVM_STACK_LIMIT);
+}
+
+/* Whether every binding of e, and of the frames it was built on, is
+ * hidden by one of the environments on the chain from n up to e */
+int lenv_shadows(lenv* n, lenv* e) {
+    for (lenv* o = e; o; o = o->outer) {
+        for (int i = 0; i < o->count; ++i) {
+            lenv* h = n;
+            while (h != e && !lenv_slot(h, o->syms[i])) { h = h->par; }
+            if (h == e) { return 0; }
+        }
+    }
+    return 1;
+}
+
+/* Applies an arithmetic or comparison operator to two numbers, without
+ * the argument list and type checks of a builtin call. */
+lval* lval_fixop(int op, long x, long y) {
+    switch (op) {
+        case LOP_ADD: return lval_num(x + y);
+        case LOP_SUB: return lval_num(x - y);
+        case LOP_MUL: return lval_num(x * y);
+        case LOP_DIV:
+            return y ? lval_num(x / y) : lval_err("Division by zero!");
+        case LOP_EQ: return lval_num(x == y);
+        case LOP_NE: return lval_num(x != y);
+        case LOP_GT: return lval_num(x > y);
+        case LOP_LT: return lval_num(x < y);
+        case LOP_GE: return lval_num(x >= y);
+        case LOP_LE: return lval_num(x <= y);
+        default: return NULL;
+    }
+}
+
+/* Applies the function below the top n values of the stack to them.
+ * Builtins and partial applications push their result, a fully applied
+ * lambda pushes a frame which leaves the result when it returns. A tail
+ * call replaces the frame of the caller instead. */
+void lvm_call(int n, int tail) {
+    lframe* fr = &vm.frames[vm.fp-1];
+    lenv* e = fr->env;
+    lval** args = &vm.stack[vm.sp - n - 1];
+
+    for (int i = 0; i <= n; ++i) {
+        if (lval_type(args[i]) == LVAL_ERR) {
+            lval* err = args[i];
+            vm.sp -= n + 1;
+            lvm_push(err);
+            return;
+        }
+    }
+
+    lval* f = args[0];
+    if (lval_type(f) != LVAL_FUN) {
+        lval* err = lval_err("S-expression starts with incorrect type!"
+            "Expected %s, got %s", ltype_name(LVAL_FUN), ltype_name(lval_type(f)));
+        vm.sp -= n + 1;
+        lvm_push(err);
+        return;
+    }
+
+    if (f->builtin && f->op != LOP_NONE && n == 2
+        && LVAL_FIXNUM(args[1]) && LVAL_FIXNUM(args[2])) {
+        lval* r = lval_fixop(f->op,
+            lval_number(args[1]), lval_number(args[2]));
+        if (r) {
+            vm.sp -= 3;
+            lvm_push(r);
+            return;
+        }
+    }
+
+    lval* a = lval_sexpr();
+    a->count = n;
+    a->cap = n;
+    a->cell = lgc_alloc(a->flags, sizeof(lval*) * n);
+    memcpy(a->cell, &args[1], sizeof(lval*) * n);
+    vm.sp -= n + 1;
+
+    if (f->builtin) {
+        lval* r = f->builtin(e, a);
+        if (r) {
+            lvm_push(r);
+        } else if (tail) {
+            fr->code = vm.cont;
+            fr->ip = 0;
+        } else if (lvm_exhausted()) {
+            lvm_push(lvm_exhausted_err());
+        } else {
+            lvm_push_frame(vm.cont, e, 0, lvm_call_size(NULL, n));
+        }
+        return;
+    }
+
+    int bound;
+    lval* err;
+    lenv* frame = lval_bind(f, a, &bound, &err);
+    if (!frame) {
+        lvm_push(err);
+        return;
+    }
+
+    /* Partial application, the new bindings travel with the function */
+    if (bound < f->code->formals->count) {
+        lvm_push(lval_fun(f->code, frame, bound));
+        return;
+    }
+
+    if (!tail) {
+        if (lvm_exhausted()) {
+            lvm_push(lvm_exhausted_err());
+            return;
+        }
+        frame->par = e;
+        lvm_push_frame(f->code, frame, 1, lvm_call_size(frame, n));
+        return;
     }
 
-    for (int i = 0; i < v->count; ++i) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
+    /* Scope is dynamic, so the caller's bindings stay visible to the
+     * callee. An environment left behind by a tail call can only be seen
+     * through the chain of the frames called from it, so it is taken out
+     * of the chain once every binding in it is shadowed nearer the head.
+     * Mutually recursive tail calls then leave one per function. */
+    frame->par = e;
+    if (fr->owner) {
+        e->flags |= LENV_LEFT;
+        lenv* p = frame;
+        while (p->par && (p->par->flags & LENV_LEFT)) {
+            if (lenv_shadows(frame, p->par)) {
+                p->par = p->par->par;
+                lgc_remember_par(p);
+            } else {
+                p = p->par;
+            }
         }
     }
 
-    if (v->count == 0) { return v; }
-    if (v->count == 1) { return lval_take(v, 0); }
+    fr->code = f->code;
+    fr->ip = 0;
+    fr->env = frame;
+    fr->owner = 1;
+    vm.heap -= fr->size;
+    fr->size = lvm_call_size(frame, n);
+    vm.heap += fr->size;
+}
+
+lval* lvm_run(lenv* e, lcode* c) {
+    int entry = vm.fp;
+    lvm_push_frame(c, e, 0, 0);
+
+    while (vm.fp > entry) {
+        if (gc.pending) { lgc_collect(); }
+
+        lframe* fr = &vm.frames[vm.fp-1];
+        int* ops = fr->code->ops;
+        lval** consts = fr->code->consts;
 
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval_del(f);
-        lval_del(v);
-        return lval_err("S-expression starts with incorrect type!"
-            "Expected %s, got %s", ltype_name(LVAL_FUN), ltype_name(f->type));
+        switch (ops[fr->ip++]) {
+            case OP_CONST:
+                lvm_push(consts[ops[fr->ip++]]);
+                break;
+            /* A symbol never bound outside the global environment can only
+             * be found there. Its slot is cached in the operand after the
+             * symbol, and holds whatever def or = last stored. */
+            case OP_LOOKUP: {
+                lval* k = consts[ops[fr->ip]];
+                int* cache = &ops[fr->ip + 1];
+                fr->ip += 2;
+
+                if (k->flags & LSYM_LOCAL) {
+                    lvm_push(lenv_get(fr->env, k));
+                    break;
+                }
+
+                lenv* g = gc.root;
+                if (*cache >= g->count || g->syms[*cache] != k) {
+                    *cache = lenv_find(g, k);
+                    if (*cache == -1) {
+                        *cache = 0;
+                        lvm_push(lenv_get(g, k));
+                        break;
+                    }
+                }
+                lvm_push(g->vals[*cache]);
+                break;
+            }
+            case OP_LOCAL: {
+                /* The slot no longer holds the formal when it was given
+                 * twice, or when it was bound by a partial application and
+                 * lives in the frame this one is built on. Fall back to a
+                 * lookup by name then */
+                int slot = ops[fr->ip++] - fr->env->base;
+                lval* k = consts[ops[fr->ip++]];
+                lenv* env = fr->env;
+                lvm_push(slot >= 0 && slot < env->count && env->syms[slot] == k
+                    ? env->vals[slot] : lenv_get(env, k));
+                break;
+            }
+            case OP_CALL:
+                lvm_call(ops[fr->ip++], 0);
+                break;
+            case OP_TAILCALL:
+                lvm_call(ops[fr->ip++], 1);
+                break;
+            case OP_IF: {
+                lval* f = vm.stack[vm.sp-2];
+                lval* cond = vm.stack[vm.sp-1];
+                int then_k = ops[fr->ip];
+                int else_k = ops[fr->ip+1];
+                int else_at = ops[fr->ip+2];
+                int end_at = ops[fr->ip+3];
+
+                if (lval_type(f) == LVAL_FUN && f->builtin == builtin_if
+                    && lval_type(cond) == LVAL_NUM) {
+                    fr->ip = lval_number(cond) ? fr->ip + 4 : else_at;
+                    vm.sp -= 2;
+                } else {
+                    fr->ip = end_at;
+                    lvm_push(consts[then_k]);
+                    lvm_push(consts[else_k]);
+                    lvm_call(3, 0);
+                }
+                break;
+            }
+            case OP_JUMP:
+                fr->ip = ops[fr->ip];
+                break;
+            case OP_GUARD:
+                fr->ip = fr->code->version == vm.version
+                    ? fr->ip + 1 : ops[fr->ip];
+                break;
+            case OP_RET:
+                vm.heap -= fr->size;
+                vm.fp--;
+                break;
+        }
     }
 
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    return lvm_pop();
 }
 
 lval* lval_eval(lenv* e, lval* v) {
-    if(v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+    if (lval_type(v) != LVAL_SYM && lval_type(v) != LVAL_SEXPR) { return v; }
+
+    lcode* c = lval_compile(v);
+
+    return lvm_run(e, c);
+}
+
+/* Evaluates a top-level form in an arena of its own and prints its value,
+ * or only an error when errors is set, before the arena ends and the value
+ * is collected with the rest of what the form left behind. */
+void lval_eval_form(lenv* e, lval* x, int errors) {
+    lgc_arena_begin();
+    x = lval_eval(e, x);
+    if (!errors || lval_type(x) == LVAL_ERR) { lval_println(x); }
+    lgc_arena_end();
+}
+
+/* Evaluates a file in the global environment line by line, each line as
+ * soon as it is read from a mapping of the file, or from a copy when it
+ * has no size to map, and prints the errors they give. As in the REPL
+ * and batch mode the expressions of a line are evaluated together as one
+ * S-expression, and a line that leaves one open goes on with the next.
+ * Each line is evaluated in an arena of its own, so memory use follows
+ * the forms alive rather than the size of the file.
+ * Returns an error if the file cannot be read or has a syntax error. */
+lval* lval_load(char* path) {
+    if (vm.loads == LVM_LOAD_LIMIT) {
+        return lval_err("Maximum evaluation depth exceeded! "
+            "Loads nest at most %d deep", LVM_LOAD_LIMIT);
     }
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-    return v;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return lval_err("Could not load file '%s': %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        return lval_err("Could not load file '%s': %s", path, strerror(err));
+    }
+
+    char* text = NULL;
+    size_t len = 0;
+    int mapped = S_ISREG(st.st_mode) && st.st_size;
+    if (mapped) {
+        len = st.st_size;
+        text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            return lval_err("Could not load file '%s': %s", path, strerror(err));
+        }
+        posix_madvise(text, len, POSIX_MADV_SEQUENTIAL);
+    } else {
+        /* Pipes and procfs files have no size to map, so they are read
+         * to the end first */
+        size_t cap = 64 << 10;
+        text = malloc(cap);
+        ssize_t n;
+        while ((n = read(fd, text + len, cap - len))) {
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n < 0) {
+                int err = errno;
+                free(text);
+                close(fd);
+                return lval_err("Could not load file '%s': %s", path, strerror(err));
+            }
+            len += n;
+            if (len == cap) {
+                cap *= 2;
+                text = realloc(text, cap);
+            }
+        }
+    }
+    close(fd);
+
+    /* path may be in the nursery, which the collections below empty */
+    char* name = malloc(strlen(path) + 1);
+    strcpy(name, path);
+
+    lreader r = { name, text, text + len, text, NULL, 1, 1 };
+    lval* x = lval_sexpr();
+    lval* v;
+    vm.loads++;
+    while ((v = lread_expr(&r))) {
+        lval_add(x, v);
+        if (lread_eol(&r)) {
+            lval_eval_form(gc.root, x, 1);
+            x = lval_sexpr();
+        }
+    }
+    vm.loads--;
+
+    if (mapped) {
+        munmap(text, len);
+    } else {
+        free(text);
+    }
+    free(name);
+    return r.err ? r.err : lval_sexpr();
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM_ARGS("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    return lval_load(a->cell[0]->str);
+}
+
+#define LBATCH_BLOCK (64 << 10)
+
+/* Reads standard input in large blocks when it is not a terminal, and
+ * evaluates it line by line in the global environment, printing results
+ * through a fully buffered stdout. As in the REPL the expressions of a
+ * line are evaluated together as one S-expression, but a line that leaves
+ * one open goes on with the next, up to the first line end at which none
+ * is. Lines that are blank are skipped. Text still open at the end of the
+ * data read so far is read again once more has arrived, from a buffer at
+ * least twice its size so long forms are not scanned over and over. After
+ * a syntax error the rest of its line is skipped. */
+void lbatch(void) {
+    setvbuf(stdout, NULL, _IOFBF, LBATCH_BLOCK);
+
+    size_t cap = LBATCH_BLOCK;
+    size_t len = 0;
+    size_t pos = 0;
+    int eof = 0;
+    char* buf = malloc(cap);
+    lreader r = { "<stdin>", buf, buf, buf, NULL, 1, 1 };
+
+    while (1) {
+        r.end = buf + len;
+        r.p = buf + pos;
+        r.err = NULL;
+        lval* x = lval_sexpr();
+        lval* v;
+        char* next = NULL;
+        int open = 0;
+        while (!next && !open && (v = lread_expr(&r))) {
+            lval_add(x, v);
+
+            /* The line goes on with more expressions unless only spaces
+             * are left before its end. Numbers and symbols may go on in
+             * the next block. */
+            char* p = lread_eol(&r);
+            if (p && p < r.end) {
+                next = p + 1;
+            } else if (p) {
+                if (eof) { next = p; } else { open = 1; }
+            }
+        }
+        if (!next && !open) {
+            open = !eof && (!r.err || r.p == r.end
+                || !memchr(r.p, '\n', r.end - r.p));
+        }
+
+        if (open) {
+            lread_advance(&r, buf + pos);
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            r.start = buf;
+
+            size_t want = len > LBATCH_BLOCK ? len : LBATCH_BLOCK;
+            if (len + want > cap) {
+                while (len + want > cap) { cap *= 2; }
+                buf = realloc(buf, cap);
+                r.start = buf;
+            }
+
+            ssize_t n = read(STDIN_FILENO, buf + len, want);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n <= 0) { eof = 1; } else { len += n; }
+            continue;
+        }
+
+        if (next) {
+            pos = next - buf;
+            lval_eval_form(gc.root, x, 0);
+        } else if (r.err) {
+            lval_println(r.err);
+            char* nl = memchr(r.p, '\n', r.end - r.p);
+            pos = nl ? nl + 1 - buf : len;
+        } else {
+            break;
+        }
+    }
+
+    free(buf);
 }
 
-void rep(mpc_parser_t* parser, lenv* e) {
+/* Reads, evaluates and prints one line. Returns 0 at the end of input. */
+int rep(lenv* e) {
     char* input = readline("lispy> ");
+    if (!input) {
+        putchar('\n');
+        return 0;
+    }
 
     add_history(input);
 
-    mpc_result_t result;
-    if (mpc_parse("<stdin>", input, parser, &result)) {
-        lval* x = lval_eval(e, lval_read(result.output));
+    lreader r = { "<stdin>", input, input + strlen(input), input, NULL, 1, 1 };
+    lval* x = lval_read(&r);
+    if (lval_type(x) == LVAL_ERR) {
         lval_println(x);
-        lval_del(x);
-        mpc_ast_delete(result.output);
     } else {
-        mpc_err_print(result.error);
-        mpc_err_delete(result.error);
+        lval_eval_form(e, x, 0);
     }
 
     free(input);
+    return 1;
 }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin builtin) {
-    lval* k = lval_sym(name);
-    lval* v = lval_builtin(builtin);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+    lenv_put(e, lval_sym(name), lval_builtin(builtin, LOP_NONE));
+}
+
+void lenv_add_op(lenv* e, lbuiltin builtin, int op) {
+    lenv_put(e, lval_sym(lop_name[op]), lval_builtin(builtin, op));
 }
 
 void lenv_add_builtins(lenv* e) {
@@ -780,55 +2654,67 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
     
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_op(e, builtin_add, LOP_ADD);
+    lenv_add_op(e, builtin_sub, LOP_SUB);
+    lenv_add_op(e, builtin_mul, LOP_MUL);
+    lenv_add_op(e, builtin_div, LOP_DIV);
 
     lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
+    lenv_add_op(e, builtin_eq, LOP_EQ);
+    lenv_add_op(e, builtin_ne, LOP_NE);
+    lenv_add_op(e, builtin_gt, LOP_GT);
+    lenv_add_op(e, builtin_lt, LOP_LT);
+    lenv_add_op(e, builtin_ge, LOP_GE);
+    lenv_add_op(e, builtin_le, LOP_LE);
 
     lenv_add_builtin(e, "def", builtin_def);
     lenv_add_builtin(e, "=", builtin_put);
     lenv_add_builtin(e, "\\", builtin_lambda);
-    
+
+    lenv_add_builtin(e, "gc", builtin_gc);
+    lenv_add_builtin(e, "mem", builtin_mem);
+    lenv_add_builtin(e, "load", builtin_load);
 }
 
 int main(int argc, char **argv) {
+    lsym_init();
+    gc.root = lenv_new();
+    lenv_add_builtins(gc.root);
+
+    /* Files given on the command line are loaded instead of reading
+     * standard input, and the exit status is 1 if any could not be. Input
+     * is read in batches unless it is a terminal, -b and -i choose either
+     * way. */
+    int files = 0;
+    int status = 0;
+    int batch = !isatty(STDIN_FILENO);
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-b") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            batch = 0;
+        } else {
+            lval* x = lval_load(argv[i]);
+            if (lval_type(x) == LVAL_ERR) {
+                lval_println(x);
+                status = 1;
+            }
+            files++;
+        }
+    }
+    if (files) { return status; }
 
-    mpc_parser_t* number = mpc_new("number");
-    mpc_parser_t* symbol = mpc_new("symbol");
-    mpc_parser_t* sexpr = mpc_new("sexpr");
-    mpc_parser_t* qexpr = mpc_new("qexpr");
-    mpc_parser_t* expr = mpc_new("expr");
-    mpc_parser_t* lispy = mpc_new("lispy");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
-        "number   : /-?[0-9]+/ ; \
-         symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-         sexpr    : '(' <expr>* ')' ; \
-         qexpr    : '{' <expr>* '}' ; \
-         expr     : <number> | <symbol> | <sexpr> | <qexpr> ; \
-         lispy    : /^/ <expr>* /$/ ;",
-        number, symbol, sexpr, qexpr, expr, lispy);
+    if (batch) {
+        lbatch();
+        return 0;
+    }
 
     puts("Lispy Version 0.0.0.0.0.1");
     puts("Press Ctrl+c to exit\n");
 
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
-
-    while (1) {
-        rep(lispy, e);
-    }
-
-    lenv_del(e);
+    /* The collector moves the global environment out of the nursery,
+     * so it is always reached through gc.root */
+    while (rep(gc.root)) {}
 
-    mpc_cleanup(6, number, symbol, sexpr, qexpr, expr, lispy);
     return 0;
 }
\ No newline at end of file